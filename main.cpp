@@ -5,6 +5,7 @@
 #include <sstream>
 #include <chrono>
 #include <thread>
+#include <vector>
 
 const int MAP_WIDTH = 10;
 const int MAP_HEIGHT = 10;
@@ -12,6 +13,7 @@ const int WIDTH = 640;
 const int HEIGHT = 480;
 const double PIXELS_PER_CELL = 70; 
 const double AMBIENT_LIGHT = 0.4;
+const double TARGET_FRAME_TIME = 16.6; // time budget (in ms) for rendering the 3d view
 constexpr double PI = 3.1415926535897932384626;
 
 using radian = double;
@@ -45,6 +47,7 @@ bool MAP[MAP_HEIGHT][MAP_WIDTH] = {
     {true, false, false, false, false, false, false, false, false, true},
     {true, true, true, true, true, true, true, true, true, true},
 };
+int MAP_VERSION = 0; // bumped every time MAP is edited
 
 class Player {
     public:
@@ -309,6 +312,177 @@ double shootRay(double x_start, double y_start, radian angle, bool& hit_horizont
     return return_val;
 }
 
+// Result of shooting a single ray from the player position, as used when drawing a wall column
+class RayCacheEntry {
+    public:
+        RayCacheEntry();
+
+        double depth;
+        bool hit_horizontal;
+        Vector surfaceNormal;
+        double fraction; // texture coordinate along the wall
+        double x_hit;
+        double y_hit;
+        int free_col;
+        int free_row;
+        bool free_sight; // is the hit point visible from the light?
+        unsigned int stamp; // entry is only valid if this matches the stamp of the cache
+};
+
+RayCacheEntry::RayCacheEntry() : surfaceNormal(0.0, 0.0, 0.0) {
+    depth = 0.0;
+    hit_horizontal = false;
+    fraction = 0.0;
+    x_hit = 0.0;
+    y_hit = 0.0;
+    free_col = 0;
+    free_row = 0;
+    free_sight = false;
+    stamp = 0;
+}
+
+// Caches ray results for a fixed set of global angles covering 360 degrees. As long as the
+// player, the light and the map stay put, turning on the spot only needs table lookups.
+//
+// On frames where the player moved the cache is bypassed and every column shoots its own ray,
+// so those frames cost no more than before. On the first frame standing still, the entries
+// covering the field of view plus RAY_CACHE_MARGIN on each side are filled. While turning,
+// only the few entries that scroll into view are shot.
+//
+// A column never uses an entry directly. It looks at the two entries on either side of its
+// angle, and if both hit the same face of the same wall block, the exact hit is found by
+// intersecting the column's own ray with that face. Otherwise (at wall edges) the ray is shot.
+// NOTE: The render threads write to the table concurrently. Each thread only touches the
+//       entries between its own first and last column, and since neighbouring columns are
+//       several entries apart, those ranges never overlap.
+class RayCache {
+    public:
+        RayCache();
+        void validate(double x, double y);
+        void shoot(radian angle, RayCacheEntry& entry);
+        void fill(radian angle_start, radian angle_stop);
+        RayCacheEntry lookup(radian angle);
+        RayCacheEntry& entryAt(int index);
+
+        double x;
+        double y;
+        double light_x;
+        double light_y;
+        int map_version;
+        bool moved; // true if validate() dropped the cached rays this frame
+        unsigned int stamp;
+        std::vector<RayCacheEntry> entries;
+};
+
+const int RAY_CACHE_SIZE = 8192; // about 0.044 degrees per entry, finer than a pixel column
+const radian RAY_CACHE_STEP = 2.0*PI/RAY_CACHE_SIZE;
+const radian RAY_CACHE_MARGIN = 10_deg_to_rad; // filled outside the field of view, in each direction
+
+RayCache::RayCache() : entries(RAY_CACHE_SIZE) {
+    x = 0.0;
+    y = 0.0;
+    light_x = 0.0;
+    light_y = 0.0;
+    map_version = -1;
+    moved = true;
+    stamp = 1;
+}
+
+// Drop all cached rays if the player position, the light or the map changed since they were shot
+void RayCache::validate(double x, double y) {
+    moved = false;
+    if (x != this->x || y != this->y || LIGHT_X != light_x || LIGHT_Y != light_y || MAP_VERSION != map_version) {
+        this->x = x;
+        this->y = y;
+        light_x = LIGHT_X;
+        light_y = LIGHT_Y;
+        map_version = MAP_VERSION;
+        moved = true;
+        stamp++;
+    }
+}
+
+// Shoot a single ray from the cached position, without touching the table
+void RayCache::shoot(radian angle, RayCacheEntry& entry) {
+    entry.depth = shootRay(x, y, angle, entry.hit_horizontal, entry.surfaceNormal, entry.free_col, entry.free_row);
+
+    // We must distinguish between hits along horizontal or vertical walls to properly compute texture coordinates
+    entry.x_hit = x + entry.depth*cos(angle);
+    entry.y_hit = y + entry.depth*sin(angle);
+    if (entry.hit_horizontal == true) {
+        entry.fraction = entry.x_hit - floor(entry.x_hit);
+    } else {
+        entry.fraction = entry.y_hit - floor(entry.y_hit);
+    }
+    entry.free_sight = isPathClear(LIGHT_X, LIGHT_Y, entry.x_hit, entry.y_hit, entry.free_row, entry.free_col);
+}
+
+// Get a table entry (the index wraps around), shooting its ray if it is not valid
+RayCacheEntry& RayCache::entryAt(int index) {
+    index = index % RAY_CACHE_SIZE;
+    if (index < 0) {
+        index = index + RAY_CACHE_SIZE;
+    }
+    RayCacheEntry& entry = entries[index];
+    if (entry.stamp != stamp) {
+        shoot(index*RAY_CACHE_STEP, entry);
+        entry.stamp = stamp;
+    }
+    return entry;
+}
+
+// Make sure that all entries needed to look up angles in [angle_start, angle_stop] are valid
+void RayCache::fill(radian angle_start, radian angle_stop) {
+    int index_start = (int)(floor(angle_start/RAY_CACHE_STEP));
+    int index_stop = (int)(floor(angle_stop/RAY_CACHE_STEP)) + 1;
+    for (int index = index_start; index <= index_stop; index++) {
+        entryAt(index);
+    }
+}
+
+// Get the exact ray result for the given angle, from the two entries on either side of it
+RayCacheEntry RayCache::lookup(radian angle) {
+    int index = (int)(floor(angle/RAY_CACHE_STEP));
+    RayCacheEntry& before = entryAt(index);
+    RayCacheEntry& after = entryAt(index + 1);
+    RayCacheEntry result;
+
+    double line_before = round(before.hit_horizontal ? before.y_hit : before.x_hit);
+    double line_after = round(after.hit_horizontal ? after.y_hit : after.x_hit);
+    if (before.hit_horizontal != after.hit_horizontal || line_before != line_after ||
+        before.free_row != after.free_row || before.free_col != after.free_col) {
+        // The two neighbours hit different faces, so we can't tell what lies in between
+        shoot(angle, result);
+        return result;
+    }
+
+    // Both neighbours hit the same face, and so does this ray
+    result.hit_horizontal = before.hit_horizontal;
+    result.surfaceNormal = before.surfaceNormal;
+    result.free_row = before.free_row;
+    result.free_col = before.free_col;
+    if (result.hit_horizontal == true) {
+        result.depth = intersectWithHorizontalLine(x, y, angle, line_before);
+    } else {
+        result.depth = intersectWithVerticalLine(x, y, angle, line_before);
+    }
+    result.x_hit = x + result.depth*cos(angle);
+    result.y_hit = y + result.depth*sin(angle);
+    if (result.hit_horizontal == true) {
+        result.fraction = result.x_hit - floor(result.x_hit);
+    } else {
+        result.fraction = result.y_hit - floor(result.y_hit);
+    }
+    if (before.free_sight == after.free_sight) {
+        result.free_sight = before.free_sight;
+    } else {
+        result.free_sight = isPathClear(LIGHT_X, LIGHT_Y, result.x_hit, result.y_hit, result.free_row, result.free_col);
+    }
+    return result;
+}
+
+RayCache ray_cache;
+
 void renderTopDownMap(SDL_Window* window, SDL_Renderer* renderer, Player& player) {
     SDL_RenderClear(renderer);
     SDL_Rect rect; 
@@ -406,23 +580,40 @@ void renderTopDownMap(SDL_Window* window, SDL_Renderer* renderer, Player& player
     SDL_RenderPresent(renderer); 
 }
 
-void renderRayCasterWindow(SDL_Window* window, SDL_Surface* surface, Player* player, int col_start, int col_stop) {
+void renderRayCasterWindow(SDL_Window* window, SDL_Surface* surface, Player* player, int col_start, int col_stop, int render_width, int render_height) {
     const double BLOCK_HEIGHT = 1.0;
  
     // Perform raycasting
     SDL_Rect srcRect, dstRect;
-    double focal_length = WIDTH/(2.0*tan(player->fov/2.0));
+    // The render resolution may be scaled differently along each axis, so the vertical
+    // focal length (in rows) is derived from the horizontal one (in columns)
+    double focal_length = render_width/(2.0*tan(player->fov/2.0));
+    double focal_length_vertical = focal_length*(render_height*(double)WIDTH)/(render_width*(double)HEIGHT);
     double focal_length_prime;
     double depth = 0.0, angle = 0.0, height = 0.0, local_angle = 0.0, color = 200.0; 
     double x_start, x_end, y_start, y_end, fraction, x_hit, y_hit, x_fraction, y_fraction, z_hit, light_intensity, light_distance;
     Vector lightVec(0.0, 0.0, 0.0);
-    bool hit_horizontal = false;
     int y_dst, x_src, y_src;
     Uint8 r, g, b;
     Vector surfaceNormal(0.0, 0.0, 0.0);
     bool free_sight;
+
+    // Standing still: make sure the cached rays cover our columns, plus a margin at the edges
+    // of the view so that the first frames of a turn don't have to shoot any new rays
+    if (ray_cache.moved == false) {
+        radian angle_start = player->angle + atan((col_start - render_width/2.0)/focal_length);
+        radian angle_stop = player->angle + atan((col_stop - 1 - render_width/2.0)/focal_length);
+        if (col_start == 0) {
+            angle_start = angle_start - RAY_CACHE_MARGIN;
+        }
+        if (col_stop == render_width) {
+            angle_stop = angle_stop + RAY_CACHE_MARGIN;
+        }
+        ray_cache.fill(angle_start, angle_stop);
+    }
+
     for (int pixel_col = col_start; pixel_col < col_stop; pixel_col++) {
-        local_angle = atan((pixel_col - WIDTH/2.0)/focal_length);  // local angle of ray in FOV,
+        local_angle = atan((pixel_col - render_width/2.0)/focal_length);  // local angle of ray in FOV,
                                                                             //zero being straight ahead
 
         angle = player->angle + local_angle; // angle of ray in global coordinates
@@ -432,33 +623,35 @@ void renderRayCasterWindow(SDL_Window* window, SDL_Surface* surface, Player* pla
             angle = angle - 2.0*PI;
         }
         int free_col, free_row;
-        depth = shootRay(player->x, player->y, angle, hit_horizontal, surfaceNormal, free_col, free_row); // distance to hit
-
-        // We must distinguish between hits along horizontal or vertical walls to properly compute texture coordinates
-        x_hit = player->x + depth*cos(angle);
-        y_hit = player->y + depth*sin(angle);
-        if (hit_horizontal == true) {
-            fraction = x_hit - floor(x_hit);
+        RayCacheEntry ray;
+        if (ray_cache.moved == true) {
+            ray_cache.shoot(angle, ray);
         } else {
-            fraction = y_hit - floor(y_hit);
+            ray = ray_cache.lookup(angle);
         }
+        depth = ray.depth; // distance to hit
+        surfaceNormal = ray.surfaceNormal;
+        x_hit = ray.x_hit;
+        y_hit = ray.y_hit;
+        fraction = ray.fraction;
+        free_sight = ray.free_sight;
+
         x_src = (int)(wall_surface->w*fraction);
-        focal_length_prime = focal_length/cos(local_angle);
+        focal_length_prime = focal_length_vertical/cos(local_angle);
         height = focal_length_prime*BLOCK_HEIGHT/depth; // height of wall in pixels along this column
-        free_sight = isPathClear(LIGHT_X, LIGHT_Y, x_hit, y_hit, free_row, free_col);
         
-        for (int y_dst = HEIGHT/2.0 - height/2.0; y_dst < HEIGHT/2.0 + height/2.0; y_dst++) {
+        for (int y_dst = render_height/2.0 - height/2.0; y_dst < render_height/2.0 + height/2.0; y_dst++) {
             // Sample texture RGB value
-            y_src = int((y_dst-HEIGHT/2.0+height/2.0)/height*wall_surface->h);
+            y_src = int((y_dst-render_height/2.0+height/2.0)/height*wall_surface->h);
             if (y_dst < 0) {
                 y_dst = -1;
                 continue;
-            } else if (y_dst >= HEIGHT) {
+            } else if (y_dst >= render_height) {
                 break;
             }
 
             // Compute shading
-            z_hit = BLOCK_HEIGHT/2.0 - depth*(y_dst - HEIGHT/2-0)/focal_length_prime;
+            z_hit = BLOCK_HEIGHT/2.0 - depth*(y_dst - render_height/2-0)/focal_length_prime;
             lightVec.coords[0] = LIGHT_X - x_hit;
             lightVec.coords[1] = LIGHT_Y - y_hit;
             lightVec.coords[2] = LIGHT_Z - z_hit;
@@ -479,14 +672,14 @@ void renderRayCasterWindow(SDL_Window* window, SDL_Surface* surface, Player* pla
 
         // Draw the floor and ceiling
         double distance, xx, yy;
-        for (int y_dst = HEIGHT/2.0 + height/2.0; y_dst < HEIGHT; y_dst++) {
+        for (int y_dst = render_height/2.0 + height/2.0; y_dst < render_height; y_dst++) {
             if (y_dst < 0) {
                 continue;
             }
-            else if (y_dst >= HEIGHT) {
+            else if (y_dst >= render_height) {
                 break;
             }
-            distance = BLOCK_HEIGHT/2.0*focal_length/((y_dst - HEIGHT/2.0)*cos(local_angle));
+            distance = BLOCK_HEIGHT/2.0*focal_length_vertical/((y_dst - render_height/2.0)*cos(local_angle));
             xx = player->x + distance*cos(angle);
             yy = player->y + distance*sin(angle);
             x_hit = xx;
@@ -538,13 +731,123 @@ void renderRayCasterWindow(SDL_Window* window, SDL_Surface* surface, Player* pla
             r = (Uint8)(min(255, r*light_intensity));
             g = (Uint8)(min(255, g*light_intensity));
             b = (Uint8)(min(255, b*light_intensity));
-            set_pixel(surface, pixel_col, HEIGHT - y_dst - 1, r, g, b);
+            set_pixel(surface, pixel_col, render_height - y_dst - 1, r, g, b);
         }
     }
 
     //SDL_UpdateWindowSurface(window);
 }
 
+// Adjusts the internal resolution of the 3d view so that rendering it stays within a time budget.
+// Each axis is scaled independently: fewer columns means fewer rays, fewer rows means fewer
+// wall/floor/ceiling pixels to shade. The result is upscaled to the full window.
+//
+// Cutting either axis by the same fraction saves about the same amount of floor shading, but
+// columns are what keep the edges of the walls sharp, so losing them is much more visible.
+// Rows therefore go down to ROW_SCALE_FLOOR before columns are touched, then columns go down to
+// MIN_RESOLUTION_SCALE, and only then the remaining rows. Raising the resolution walks the same
+// path backwards.
+class ResolutionController {
+    public:
+        ResolutionController(double target_frame_time);
+        void update(double render_time);
+        int renderWidth();
+        int renderHeight();
+
+        double target_frame_time; // in ms
+        double average_render_time; // in ms, mean over the last measurement window
+        double render_time_sum; // in ms, over the frames measured so far in this window
+        int frames_measured;
+        bool skip_next_frame; // true right after a change of resolution
+        double scale_x; // fraction of WIDTH being rendered
+        double scale_y; // fraction of HEIGHT being rendered
+};
+
+const double RESOLUTION_STEP = 0.05;
+const double MIN_RESOLUTION_SCALE = 0.25;
+const double ROW_SCALE_FLOOR = 0.5;
+const double SCALE_TOLERANCE = RESOLUTION_STEP/2.0; // the scales drift a bit from adding up steps
+// Only lower the resolution when above the target, and only raise it when well below it.
+// The gap between the two, together with averaging over a window of frames, keeps the
+// controller from oscillating.
+const double UPSCALE_THRESHOLD = 0.8;
+const int RESOLUTION_SETTLE_FRAMES = 10;
+
+ResolutionController::ResolutionController(double target_frame_time) {
+    this->target_frame_time = target_frame_time;
+    average_render_time = target_frame_time;
+    render_time_sum = 0.0;
+    frames_measured = 0;
+    skip_next_frame = true;
+    scale_x = 1.0;
+    scale_y = 1.0;
+}
+
+// Feed the time (in ms) spent rendering the last frame, and possibly change the resolution
+void ResolutionController::update(double render_time) {
+    // The first frame at a new resolution is not typical (it also pays for filling the ray cache
+    // at the new column angles), so it is left out. Decisions are then based on the plain mean of
+    // the next RESOLUTION_SETTLE_FRAMES frames, all rendered at the current resolution.
+    if (skip_next_frame == true) {
+        skip_next_frame = false;
+        return;
+    }
+    render_time_sum = render_time_sum + render_time;
+    frames_measured++;
+    if (frames_measured < RESOLUTION_SETTLE_FRAMES) {
+        return;
+    }
+    average_render_time = render_time_sum/frames_measured;
+    render_time_sum = 0.0;
+    frames_measured = 0;
+
+    if (average_render_time > target_frame_time) {
+        // Too slow: rows down to their floor, then columns, then the rest of the rows
+        if (scale_y > ROW_SCALE_FLOOR + SCALE_TOLERANCE) {
+            scale_y = scale_y - RESOLUTION_STEP;
+        } else if (scale_x > MIN_RESOLUTION_SCALE + SCALE_TOLERANCE) {
+            scale_x = scale_x - RESOLUTION_STEP;
+        } else if (scale_y > MIN_RESOLUTION_SCALE + SCALE_TOLERANCE) {
+            scale_y = scale_y - RESOLUTION_STEP;
+        } else {
+            return;
+        }
+    } else if (average_render_time < UPSCALE_THRESHOLD*target_frame_time) {
+        // Time to spare: undo the above in reverse order
+        if (scale_y < ROW_SCALE_FLOOR - SCALE_TOLERANCE) {
+            scale_y = scale_y + RESOLUTION_STEP;
+        } else if (scale_x < 1.0 - SCALE_TOLERANCE) {
+            scale_x = scale_x + RESOLUTION_STEP;
+        } else if (scale_y < 1.0 - SCALE_TOLERANCE) {
+            scale_y = scale_y + RESOLUTION_STEP;
+        } else {
+            return;
+        }
+    } else {
+        return;
+    }
+
+    if (scale_x < MIN_RESOLUTION_SCALE) {
+        scale_x = MIN_RESOLUTION_SCALE;
+    } else if (scale_x > 1.0) {
+        scale_x = 1.0;
+    }
+    if (scale_y < MIN_RESOLUTION_SCALE) {
+        scale_y = MIN_RESOLUTION_SCALE;
+    } else if (scale_y > 1.0) {
+        scale_y = 1.0;
+    }
+    skip_next_frame = true;
+}
+
+int ResolutionController::renderWidth() {
+    return (int)(round(scale_x*WIDTH));
+}
+
+int ResolutionController::renderHeight() {
+    return (int)(round(scale_y*HEIGHT));
+}
+
 int main(int argc, char * argv[]) {
     const int TOP_DOWN_WINDOW_WIDTH = PIXELS_PER_CELL*MAP_WIDTH;
     const int TOP_DOWN_WINDOW_HEIGHT = PIXELS_PER_CELL*MAP_HEIGHT;
@@ -572,6 +875,10 @@ int main(int argc, char * argv[]) {
     window_3dview = SDL_CreateWindow("Raycaster", 100, 100, WIDTH, HEIGHT, SDL_WINDOW_SHOWN);
     surface_3dview = SDL_GetWindowSurface(window_3dview);
 
+    // The 3d view is rendered into the top-left corner of this surface, and then upscaled to the window
+    SDL_Surface* render_surface = SDL_CreateRGBSurfaceWithFormat(0, WIDTH, HEIGHT, 32, surface_3dview->format->format);
+    ResolutionController resolution_controller(TARGET_FRAME_TIME);
+
     Player player;
 
     // Load textures
@@ -642,6 +949,7 @@ int main(int argc, char * argv[]) {
                             int player_y_cell = (int)(floor(player.y));
                             if (x_cell != player_x_cell || y_cell != player_y_cell) {
                                 MAP[y_cell][x_cell] = !MAP[y_cell][x_cell];
+                                MAP_VERSION++;
                             }
                         }
                     }
@@ -667,14 +975,25 @@ int main(int argc, char * argv[]) {
 
         // Render the current frame
         renderTopDownMap(window_topdown, renderer_topdown, player);
-        std::thread thread1(renderRayCasterWindow, window_3dview, surface_3dview, &player, 0, 320);
-        std::thread thread2(renderRayCasterWindow, window_3dview, surface_3dview, &player, 320, 640);
+        int render_width = resolution_controller.renderWidth();
+        int render_height = resolution_controller.renderHeight();
+        auto render_start_time = std::chrono::steady_clock::now();
+        ray_cache.validate(player.x, player.y);
+        std::thread thread1(renderRayCasterWindow, window_3dview, render_surface, &player, 0, render_width/2, render_width, render_height);
+        std::thread thread2(renderRayCasterWindow, window_3dview, render_surface, &player, render_width/2, render_width, render_width, render_height);
         thread1.join();
         thread2.join();
+        auto render_stop_time = std::chrono::steady_clock::now();
+        double render_time = std::chrono::duration_cast<std::chrono::microseconds>(render_stop_time - render_start_time).count();
+        resolution_controller.update(render_time / 1e3);
+
+        // Upscale the rendered part to the window
+        SDL_Rect render_rect = {0, 0, render_width, render_height};
+        SDL_BlitScaled(render_surface, &render_rect, surface_3dview, NULL);
 
         // Render fps in window
         std::stringstream ss;
-        ss << "FPS: " << 1.0/delta_t;
+        ss << "FPS: " << 1.0/delta_t << " (" << render_width << "x" << render_height << ")";
 
         SDL_Color text_color = {255, 255, 255};
         SDL_Surface* text_surface = TTF_RenderText_Solid(font, ss.str().c_str(), text_color);
@@ -691,6 +1010,7 @@ int main(int argc, char * argv[]) {
     }
 
     // Quit
+    SDL_FreeSurface(render_surface);
     SDL_DestroyWindow(window_topdown);
     SDL_DestroyWindow(window_3dview);
     SDL_Quit(); 